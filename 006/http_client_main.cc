@@ -1,18 +1,36 @@
 #include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <nlohmann/json.hpp>
+#include <openssl/ssl.h>
+#include <sys/resource.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace asio = boost::asio;
 
-using namespace std::placeholders;
 using json = nlohmann::json;
 
 // The HTTP URLs to fetch will come from a JSON file.
@@ -21,25 +39,586 @@ DEFINE_string(sites_path, "",
 
 DEFINE_bool(print_body, false, "Print the HTTP GET response body.");
 
+DEFINE_bool(accept_encoding, false,
+            "Ask servers for gzip or deflate compressed response bodies.");
+
+DEFINE_string(tls_ca_path, "",
+              "PEM file of trusted certificates for https sites. Defaults to "
+              "the system certificate store.");
+
+DEFINE_bool(tls_verify, true, "Verify the certificates of https sites.");
+
+// Each stage of the fetch pipeline gets its own concurrency limit, plus a
+// bounded queue of sites waiting for a free slot.
+DEFINE_int32(resolve_concurrency, 16,
+             "Maximum number of DNS lookups at once, each on its own thread.");
+DEFINE_int32(connect_concurrency, 64,
+             "Maximum number of connects and TLS handshakes at once.");
+DEFINE_int32(fetch_concurrency, 64,
+             "Maximum number of HTTP requests in flight at once.");
+DEFINE_int32(queue_depth, 128,
+             "Maximum number of sites waiting in front of each stage.");
+
+DEFINE_int32(tls_session_cache_size, 10000,
+             "Maximum number of hosts to keep TLS sessions for.");
+
+DEFINE_int32(stats_interval_ms, 1000,
+             "How often to log pipeline stage stats, or 0 to disable.");
+
+// Upper bound on a single body read, which also bounds how much of the body is
+// buffered at once. Decoded output is handed on in pieces of the same size.
+const size_t kReadSize = 16384;
+
+// Parses the body or chunk length at the start of the string. At least one
+// digit is required, and the number may only be followed by the end of the
+// string, a chunk extension (";") or whitespace, including the "end of line".
+bool parse_length(const std::string& s, int base, size_t* len) {
+    if (s.empty() || !std::isxdigit(static_cast<unsigned char>(s[0])) ||
+        (base == 10 && !std::isdigit(static_cast<unsigned char>(s[0])))) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long value = std::strtoull(s.c_str(), &end, base);
+    if (errno == ERANGE ||
+        (*end != '\0' && *end != ';' &&
+         !std::isspace(static_cast<unsigned char>(*end)))) {
+        return false;
+    }
+    *len = static_cast<size_t>(value);
+    return true;
+}
+
+// Returns the value of a header field with surrounding whitespace trimmed, or
+// an empty string if the field is missing. Field names are case insensitive,
+// so the header is expected to be converted to lower case already.
+std::string header_value(const std::string& header, const std::string& name) {
+    // Every field follows the "end of line" of the status line or the field
+    // before it.
+    size_t pos = header.find("\r\n" + name + ":");
+    if (pos == std::string::npos) {
+        return "";
+    }
+    size_t begin = header.find_first_not_of(" \t", pos + name.size() + 3);
+    size_t end = header.find("\r\n", begin);
+    if (begin == std::string::npos || end == std::string::npos) {
+        return "";
+    }
+    end = header.find_last_not_of(" \t", end - 1) + 1;
+    return begin < end ? header.substr(begin, end - begin) : "";
+}
+
+// Running totals shared by every HttpClient, reported once all fetches have
+// finished. Comparing the two byte counts shows how much the compressed
+// transfer saved us, while the handshake counts show how often TLS session
+// resumption kicked in.
+struct FetchStats {
+    size_t responses = 0;
+    size_t wire_bytes = 0;     // Body bytes as they arrived from the server.
+    size_t decoded_bytes = 0;  // Body bytes after removing Content-Encoding.
+
+    size_t full_handshakes = 0;
+    size_t resumed_handshakes = 0;
+    std::chrono::microseconds full_handshake_time{0};
+    std::chrono::microseconds resumed_handshake_time{0};
+
+    // Heap memory each client held on top of its slot, summed over clients.
+    size_t clients = 0;
+    size_t client_heap_bytes = 0;
+};
+
+// Remembers the most recent TLS session handed out by each server, so the next
+// connection to the same host can offer it back and skip the expensive key
+// exchange with an abbreviated handshake. A single cache is attached to the
+// SSL context shared by all clients.
+class TlsSessionCache {
+public:
+    explicit TlsSessionCache(asio::ssl::context& context) {
+        // OpenSSL's internal cache is only useful for servers, so we keep our
+        // own and have OpenSSL tell us whenever a new session shows up. With
+        // TLS 1.3 that happens after the handshake, once the server's session
+        // ticket is read along with the response.
+        SSL_CTX* ctx = context.native_handle();
+        SSL_CTX_set_session_cache_mode(
+            ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_set_ex_data(ctx, ex_index(), this);
+        SSL_CTX_sess_set_new_cb(ctx, &TlsSessionCache::on_new_session);
+    }
+
+    TlsSessionCache(const TlsSessionCache&) = delete;
+    TlsSessionCache& operator=(const TlsSessionCache&) = delete;
+
+    ~TlsSessionCache() {
+        for (auto& entry : sessions_) {
+            SSL_SESSION_free(entry.second);
+        }
+    }
+
+    // Offers a cached session for the host to the server, if we have one.
+    // The server is free to turn it down and fall back to a full handshake.
+    void Resume(SSL* ssl, const std::string& host) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = sessions_.find(host);
+        if (it != sessions_.end()) {
+            SSL_set_session(ssl, it->second);
+        }
+    }
+
+private:
+    // The asio context already keeps its verify callback in the app data
+    // slot, so the cache needs an extra data slot of its own.
+    static int ex_index() {
+        static const int index =
+            SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return index;
+    }
+
+    static int on_new_session(SSL* ssl, SSL_SESSION* session) {
+        // Sessions are keyed by the SNI host name every client sets before
+        // its handshake.
+        const char* host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+        if (host == nullptr) {
+            return 0;
+        }
+
+        TlsSessionCache* cache = static_cast<TlsSessionCache*>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_index()));
+        std::lock_guard<std::mutex> lock(cache->mutex_);
+        auto it = cache->sessions_.find(host);
+        if (it != cache->sessions_.end()) {
+            SSL_SESSION_free(it->second);
+            it->second = session;
+            return 1;
+        }
+
+        // Long runs visit far more hosts than are worth remembering, so the
+        // oldest host makes way once the cache is full.
+        if (cache->sessions_.size() >=
+                static_cast<size_t>(FLAGS_tls_session_cache_size)) {
+            auto oldest = cache->sessions_.find(cache->order_.front());
+            SSL_SESSION_free(oldest->second);
+            cache->sessions_.erase(oldest);
+            cache->order_.pop_front();
+        }
+        cache->sessions_[host] = session;
+        cache->order_.push_back(host);
+
+        // Returning 1 tells OpenSSL we've taken over its session reference.
+        return 1;
+    }
+
+    std::mutex mutex_;
+    std::map<std::string, SSL_SESSION*> sessions_;
+    std::deque<std::string> order_;  // Hosts in sessions_, oldest first.
+};
+
+// Peak resident set size of the process so far, in bytes.
+size_t max_rss_bytes() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+}
+
+// Hands out a single shared copy of each host name, so the many paths fetched
+// from one host don't each carry their own. Names are reference counted and
+// dropped once the last client using them is gone.
+class HostTable {
+public:
+    HostTable() { }
+    HostTable(const HostTable&) = delete;
+    HostTable& operator=(const HostTable&) = delete;
+
+    // Elements of an unordered_map never move, so the returned reference
+    // stays valid until the matching Release().
+    const std::string& Intern(const std::string& host) {
+        auto it = hosts_.emplace(host, 0).first;
+        it->second++;
+        return it->first;
+    }
+
+    void Release(const std::string& host) {
+        auto it = hosts_.find(host);
+        if (--it->second == 0) {
+            hosts_.erase(it);
+        }
+    }
+
+private:
+    std::unordered_map<std::string, size_t> hosts_;
+};
+
+// Recycles fixed size slots for objects of type T. Slots are carved out of
+// blocks that are never handed back to the heap, but since the pipeline limits
+// how many objects are alive at once, the pool stops growing once it reaches
+// that peak. Not thread safe; like everything else here it's only used from
+// the io_service thread.
+template <typename T>
+class SlabPool {
+public:
+    SlabPool() { }
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    void* Allocate() {
+        if (free_ == nullptr) {
+            grow();
+        }
+        Slot* slot = free_;
+        free_ = slot->next;
+        in_use_++;
+        peak_in_use_ = std::max(peak_in_use_, in_use_);
+        return slot;
+    }
+
+    void Free(void* p) {
+        Slot* slot = static_cast<Slot*>(p);
+        slot->next = free_;
+        free_ = slot;
+        in_use_--;
+    }
+
+    static size_t slot_size() { return sizeof(Slot); }
+    size_t reserved_bytes() const { return blocks_.size() * sizeof(Block); }
+    size_t peak_in_use() const { return peak_in_use_; }
+
+private:
+    // A free slot doubles as a free list node.
+    union Slot {
+        Slot* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    static const size_t kSlotsPerBlock = 64;
+    using Block = std::array<Slot, kSlotsPerBlock>;
+
+    void grow() {
+        blocks_.emplace_back(new Block);
+        for (Slot& slot : *blocks_.back()) {
+            slot.next = free_;
+            free_ = &slot;
+        }
+    }
+
+    std::vector<std::unique_ptr<Block>> blocks_;
+    Slot* free_ = nullptr;
+    size_t in_use_ = 0;
+    size_t peak_in_use_ = 0;
+};
+
+// A fixed size buffer for data received from the server. It lives right inside
+// each client, and with it inside the client's slab slot, so receiving a
+// response doesn't allocate anything. The capacity also caps the size of the
+// response header.
+class ReceiveBuffer {
+public:
+    static const size_t kCapacity = 16384;
+
+    const char* data() const { return data_ + begin_; }
+    size_t size() const { return end_ - begin_; }
+    bool full() const { return size() == kCapacity; }
+
+    // Returns the length of the data up to and including the delimiter, or
+    // zero if the delimiter hasn't arrived yet.
+    size_t find(const char* delim) const {
+        const char* delim_end = delim + std::strlen(delim);
+        const char* it = std::search(data(), data() + size(), delim, delim_end);
+        return it == data() + size() ? 0 : it - data() + (delim_end - delim);
+    }
+
+    void consume(size_t n) {
+        begin_ += n;
+        if (begin_ == end_) {
+            begin_ = end_ = 0;
+        }
+    }
+
+    // Returns free space for at most max_size more bytes, moving any unread
+    // data to the front first so the whole capacity is available.
+    asio::mutable_buffer prepare(size_t max_size) {
+        if (begin_ > 0) {
+            std::memmove(data_, data_ + begin_, size());
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        return asio::mutable_buffer(data_ + end_,
+                                    std::min(max_size, kCapacity - end_));
+    }
+
+    void commit(size_t n) { end_ += n; }
+
+private:
+    char data_[kCapacity];
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
+
+// Runs DNS lookups on a pool of worker threads. Asio's own async_resolve()
+// hands every lookup to a single background thread, so no matter how many are
+// started only one getaddrinfo() call is ever running. Here each worker thread
+// performs blocking lookups, and the results are posted back to the main
+// io_service so handlers run on the same thread as everything else.
+class ResolverPool {
+public:
+    using Handler = std::function<void(const boost::system::error_code&,
+                                       asio::ip::tcp::resolver::iterator)>;
+
+    ResolverPool(asio::io_service& io_service, size_t threads)
+        : io_service_(io_service), work_(new asio::io_service::work(workers_)) {
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this]() { workers_.run(); });
+        }
+    }
+
+    ResolverPool(const ResolverPool&) = delete;
+    ResolverPool& operator=(const ResolverPool&) = delete;
+
+    ~ResolverPool() {
+        work_.reset();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    void AsyncResolve(const asio::ip::tcp::resolver::query& query,
+                      Handler handler) {
+        // The main io_service only counts as busy once the result is posted
+        // back, so keep it from running out of work in the meantime.
+        auto work = std::make_shared<asio::io_service::work>(io_service_);
+        workers_.post([this, query, handler, work]() {
+            asio::ip::tcp::resolver resolver(workers_);
+            boost::system::error_code ec;
+            asio::ip::tcp::resolver::iterator it = resolver.resolve(query, ec);
+            io_service_.post([handler, ec, it]() { handler(ec, it); });
+        });
+    }
+
+private:
+    asio::io_service& io_service_;
+    asio::io_service workers_;
+    std::unique_ptr<asio::io_service::work> work_;
+    std::vector<std::thread> threads_;
+};
+
+// Incrementally undoes the "gzip" or "deflate" Content-Encoding of a response
+// body. Input is fed in whatever pieces the socket hands us and decoded output
+// is passed to a sink one fixed size buffer at a time, so memory use stays
+// bounded by the zlib window plus the output buffer no matter how large the
+// body is. The sink is done with the output before Feed() returns, so a single
+// output buffer is shared by all decoders.
+class ContentDecoder {
+public:
+    enum class Encoding { kIdentity, kGzip, kDeflate };
+
+    using Sink = std::function<void(const char*, size_t)>;
+
+    ContentDecoder() { }
+    ContentDecoder(const ContentDecoder&) = delete;
+    ContentDecoder& operator=(const ContentDecoder&) = delete;
+
+    ~ContentDecoder() {
+        if (inflating_) {
+            inflateEnd(&zs_);
+        }
+    }
+
+    void Reset(Encoding encoding) {
+        if (inflating_) {
+            inflateEnd(&zs_);
+            inflating_ = false;
+        }
+        encoding_ = encoding;
+        sniff_size_ = 0;
+        finished_ = false;
+        zlib_bytes_ = 0;
+    }
+
+    // Returns false if the body turns out to be corrupt.
+    bool Feed(const char* data, size_t size, const Sink& sink) {
+        if (encoding_ == Encoding::kIdentity) {
+            sink(data, size);
+            return true;
+        }
+        if (!inflating_) {
+            // Plenty of servers label a raw deflate stream as "deflate" even
+            // though the spec calls for a zlib wrapper. The two byte zlib
+            // header is easy to recognize, so hold on to the first two bytes
+            // until we know which flavor we're dealing with.
+            while (sniff_size_ < sizeof(sniff_) && size > 0) {
+                sniff_[sniff_size_++] = *data++;
+                --size;
+            }
+            if (sniff_size_ < sizeof(sniff_)) {
+                return true;
+            }
+            if (!start_inflate()) {
+                return false;
+            }
+            if (!inflate_some(sniff_, sniff_size_, sink)) {
+                return false;
+            }
+        }
+        return inflate_some(data, size, sink);
+    }
+
+    // Returns true if the compressed stream was complete. An encoded body
+    // that turns out to be empty, such as one with a "Content-Length: 0", is
+    // complete as well.
+    bool Finish() const {
+        return encoding_ == Encoding::kIdentity || finished_ ||
+            (!inflating_ && sniff_size_ == 0);
+    }
+
+    // Bytes zlib allocated for the current body, mostly its window.
+    size_t zlib_bytes() const { return zlib_bytes_; }
+
+private:
+    static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+        static_cast<ContentDecoder*>(opaque)->zlib_bytes_ +=
+            static_cast<size_t>(items) * size;
+        return std::calloc(items, size);
+    }
+
+    static void zlib_free(voidpf, voidpf address) {
+        std::free(address);
+    }
+
+    bool start_inflate() {
+        // A window of 2^15 bytes is the largest zlib supports and what every
+        // compressor uses by default. Adding 16 selects the gzip wrapper,
+        // while a negative value selects a raw deflate stream.
+        int window_bits = 15;
+        if (encoding_ == Encoding::kGzip) {
+            window_bits += 16;
+        } else if ((static_cast<unsigned char>(sniff_[0]) & 0x0f) != Z_DEFLATED
+                   || ((static_cast<unsigned char>(sniff_[0]) << 8)
+                       | static_cast<unsigned char>(sniff_[1])) % 31 != 0) {
+            window_bits = -window_bits;
+        }
+
+        zs_ = z_stream();
+        zs_.zalloc = zlib_alloc;
+        zs_.zfree = zlib_free;
+        zs_.opaque = this;
+        if (inflateInit2(&zs_, window_bits) != Z_OK) {
+            LOG(ERROR) << "Error initializing zlib: " << zs_.msg;
+            return false;
+        }
+        inflating_ = true;
+        return true;
+    }
+
+    bool inflate_some(const char* data, size_t size, const Sink& sink) {
+        zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs_.avail_in = static_cast<uInt>(size);
+
+        // Keep going while there is input left, or while the last call filled
+        // the whole output buffer and zlib may still be holding output back.
+        bool out_full = false;
+        while (!finished_ && (zs_.avail_in > 0 || out_full)) {
+            zs_.next_out = reinterpret_cast<Bytef*>(out_);
+            zs_.avail_out = sizeof(out_);
+
+            int ret = inflate(&zs_, Z_NO_FLUSH);
+            size_t produced = sizeof(out_) - zs_.avail_out;
+            out_full = zs_.avail_out == 0;
+            if (produced > 0) {
+                sink(out_, produced);
+            }
+
+            if (ret == Z_STREAM_END) {
+                finished_ = true;
+            } else if (ret == Z_BUF_ERROR) {
+                // No progress was possible, zlib needs more input.
+                break;
+            } else if (ret != Z_OK) {
+                LOG(ERROR) << "Error decoding body: "
+                           << (zs_.msg ? zs_.msg : "unknown zlib error");
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Encoding encoding_ = Encoding::kIdentity;
+    bool inflating_ = false;
+    bool finished_ = false;
+
+    z_stream zs_;
+    char sniff_[2];
+    size_t sniff_size_ = 0;
+    size_t zlib_bytes_ = 0;
+
+    static char out_[kReadSize];
+};
+
+char ContentDecoder::out_[kReadSize];
+
 // All network and HTTP related operations for a given host and path will be
 // handled by the HttpClient class.
 class HttpClient {
 public:
-    HttpClient(asio::io_service& io_service, asio::ip::tcp::resolver& resolver,
-               const std::string& host, const std::string& path)
-        : host_(host), path_(path), resolver_(resolver), sock_(io_service) { }
+    HttpClient(asio::io_service& io_service, ResolverPool& resolver,
+               asio::ssl::context& ssl_context, TlsSessionCache& session_cache,
+               HostTable& hosts, FetchStats& stats, const std::string& host,
+               const std::string& path, unsigned short port, bool use_tls)
+        : host_(hosts.Intern(host)), path_(path), resolver_(resolver),
+          ssl_context_(ssl_context), session_cache_(session_cache),
+          hosts_(hosts), stats_(stats), io_service_(io_service),
+          sock_(io_service), port_(port), use_tls_(use_tls) { }
 
-    void Start() {
+    HttpClient(const HttpClient&) = delete;
+    HttpClient& operator=(const HttpClient&) = delete;
+
+    ~HttpClient() {
+        // OpenSSL treats a connection freed without a shutdown as broken and
+        // marks its session as not resumable, which would leave dead sessions
+        // in the TlsSessionCache. Fatal TLS errors already invalidate the
+        // session on their own, so rather than waiting on a close_notify
+        // exchange we just mark the connection as closed.
+        if (tls_) {
+            SSL_set_shutdown(tls_->native_handle(), SSL_SENT_SHUTDOWN);
+        }
+        ++stats_.clients;
+        stats_.client_heap_bytes += heap_bytes();
+        hosts_.Release(host_);
+    }
+
+    // Clients come and go for every site, so they live in recycled slots
+    // rather than fresh heap allocations. The slot holds the receive buffer
+    // and decoder too; only the path, the done callback, zlib's state and the
+    // TLS stream of an https site still come from the heap.
+    static void* operator new(size_t size) {
+        CHECK(size == sizeof(HttpClient));
+        return pool_.Allocate();
+    }
+
+    static void operator delete(void* p) {
+        pool_.Free(p);
+    }
+
+    static const SlabPool<HttpClient>& pool() { return pool_; }
+
+    // Called with the outcome of each stage once it's complete.
+    using Done = std::function<void(bool ok)>;
+
+    // Fetching a site is split into three stages, run one after the other by
+    // the FetchPipeline. Each stage reports back through its done callback,
+    // so the pipeline decides when the next one gets to start.
+    void Resolve(Done done) {
         // The client must start by resolving the hostname into an IP endpoint.
-        // This will give us a destination for the TCP connection. We can
-        // safely hard code the "http" service name.
-        resolver_.async_resolve(
-            asio::ip::tcp::resolver::query(host_, "http"),
+        // This will give us a destination for the TCP connection. The service
+        // is either "http", "https" or an explicit port number.
+        done_ = std::move(done);
+        resolver_.AsyncResolve(
+            asio::ip::tcp::resolver::query(
+                host_, port_ ? std::to_string(port_) :
+                       use_tls_ ? "https" : "http"),
             [this](const boost::system::error_code& ec,
                    asio::ip::tcp::resolver::iterator it) {
                 if (ec) {
                     LOG(ERROR) << "Error resolving " << host_ << ": "
                                << ec.message();
+                    finish(false);
                     return;
                 }
 
@@ -47,11 +626,75 @@ public:
                 // be available.
                 std::cout << host_ << ": resolved to " << it->endpoint()
                           << std::endl;
-                do_connect(it->endpoint());
+                endpoint_ = it->endpoint();
+                finish(true);
             });
     }
 
+    // Connects to the resolved endpoint, including the TLS handshake for
+    // https sites.
+    void Connect(Done done) {
+        done_ = std::move(done);
+        do_connect(endpoint_);
+    }
+
+    // Sends the GET request and receives the full response.
+    void Fetch(Done done) {
+        done_ = std::move(done);
+        do_send_http_get();
+    }
+
 private:
+    // The HTTP code below doesn't care whether it talks to the TLS stream of
+    // an https site or directly to the socket, so these helpers pick the
+    // right one for each read and write.
+    template <typename Buffers, typename Handler>
+    void stream_write(const Buffers& buffers, Handler handler) {
+        if (tls_) {
+            asio::async_write(*tls_, buffers, handler);
+        } else {
+            asio::async_write(sock_, buffers, handler);
+        }
+    }
+
+    // Works like asio::async_read_until(), but reads into the fixed receive
+    // buffer. The handler is always called through the io_service, even if
+    // the delimiter is already buffered, so a long run of buffered chunks
+    // can't recurse too deeply.
+    template <typename Handler>
+    void stream_read_until(const char* delim, Handler handler) {
+        size_t size = response_.find(delim);
+        if (size > 0 || response_.full()) {
+            boost::system::error_code ec;
+            if (size == 0) {
+                ec = asio::error::not_found;
+            }
+            io_service_.post([handler, ec, size]() { handler(ec, size); });
+            return;
+        }
+
+        stream_read_some(
+            response_.prepare(ReceiveBuffer::kCapacity),
+            [this, delim, handler](const boost::system::error_code& ec,
+                                   std::size_t size) {
+                if (ec) {
+                    handler(ec, 0);
+                    return;
+                }
+                response_.commit(size);
+                stream_read_until(delim, handler);
+            });
+    }
+
+    template <typename Handler>
+    void stream_read_some(const asio::mutable_buffer& buf, Handler handler) {
+        if (tls_) {
+            tls_->async_read_some(asio::buffer(buf), handler);
+        } else {
+            sock_.async_read_some(asio::buffer(buf), handler);
+        }
+    }
+
     void do_connect(const asio::ip::tcp::endpoint& dest) {
         // Remember that the Asio library will make copies of parameters passed
         // by const reference, so it's ok to let the endpoint go out of scope
@@ -61,25 +704,89 @@ private:
                 if (ec) {
                     LOG(ERROR) << "Error connecting to " << host_ << ": "
                                << ec.message();
+                    finish(false);
                     return;
                 }
 
                 std::cout << host_ << ": connected to "
                           << sock_.remote_endpoint() << std::endl;
-                do_send_http_get();
+                if (use_tls_) {
+                    do_tls_handshake();
+                } else {
+                    finish(true);
+                }
+            });
+    }
+
+    void do_tls_handshake() {
+        // The TLS stream only borrows our socket, so plain HTTP clients never
+        // pay for the SSL object.
+        tls_.reset(new asio::ssl::stream<asio::ip::tcp::socket&>(
+            sock_, ssl_context_));
+
+        // Servers hosting several domains pick the certificate by the SNI
+        // host name, which also happens to be our session cache key.
+        SSL* ssl = tls_->native_handle();
+        SSL_set_tlsext_host_name(ssl, host_.c_str());
+        if (FLAGS_tls_verify) {
+            tls_->set_verify_callback(asio::ssl::rfc2818_verification(host_));
+        }
+        session_cache_.Resume(ssl, host_);
+
+        auto start = std::chrono::steady_clock::now();
+        tls_->async_handshake(
+            asio::ssl::stream_base::client,
+            [this, start](const boost::system::error_code& ec) {
+                if (ec) {
+                    LOG(ERROR) << "Error in TLS handshake with " << host_
+                               << ": " << ec.message();
+                    finish(false);
+                    return;
+                }
+
+                auto elapsed =
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start);
+                bool resumed = SSL_session_reused(tls_->native_handle());
+                if (resumed) {
+                    stats_.resumed_handshakes++;
+                    stats_.resumed_handshake_time += elapsed;
+                } else {
+                    stats_.full_handshakes++;
+                    stats_.full_handshake_time += elapsed;
+                }
+
+                std::cout << host_ << ": " << (resumed ? "resumed" : "full")
+                          << " TLS handshake in " << elapsed.count() << "us"
+                          << std::endl;
+                finish(true);
             });
     }
 
     void do_send_http_get() {
         // At minimum, the remote server needs to know the path being fetched
         // and the host serving that path. The latter is required because a
-        // single server often hosts multiple domains.
-        request_ = "GET " + path_ + " HTTP/1.1\r\nHost: " + host_ + "\r\n\r\n";
-        asio::async_write(
-            sock_, asio::buffer(request_),
+        // single server often hosts multiple domains. The request is gathered
+        // straight from the path, the interned host and string literals, so
+        // there's no need to keep a formatted copy around while it's sent.
+        static const char kAcceptEncoding[] =
+            "Accept-Encoding: gzip, deflate\r\n";
+        std::array<asio::const_buffer, 7> request = {{
+            asio::buffer("GET ", 4),
+            asio::buffer(path_),
+            asio::buffer(" HTTP/1.1\r\nHost: ", 17),
+            asio::buffer(host_),
+            asio::buffer("\r\n", 2),
+            asio::buffer(kAcceptEncoding,
+                         FLAGS_accept_encoding ? sizeof(kAcceptEncoding) - 1
+                                               : 0),
+            asio::buffer("\r\n", 2)}};
+        stream_write(
+            request,
             [this](const boost::system::error_code& ec, std::size_t size) {
                 if (ec) {
                     LOG(ERROR) << "Error sending GET " << ec;
+                    finish(false);
                     return;
                 }
 
@@ -92,98 +799,535 @@ private:
         // Since HTTP/1.1 is a text based protocol, most of it is human readable
         // by design. Notice how the "double end of line" character sequence
         // ("\r\n\r\n") is used to delimit message sections.
-        asio::async_read_until(
-            sock_, response_, "\r\n\r\n",
+        stream_read_until(
+            "\r\n\r\n",
             [this](const boost::system::error_code& ec, std::size_t size) {
                 if (ec) {
                     LOG(ERROR) << "Error receiving GET header " << ec;
+                    finish(false);
                     return;
                 }
 
-                LOG(INFO) << host_ << ": received " << size << ", streambuf "
+                LOG(INFO) << host_ << ": received " << size << ", buffered "
                           << response_.size();
 
-                // The asio::streambuf class can use multiple buffers
-                // internally, so we need to use a special iterator to copy out
-                // the header.
-                std::string header(
-                    asio::buffers_begin(response_.data()),
-                    asio::buffers_begin(response_.data()) + size);
+                std::string header(response_.data(), size);
                 response_.consume(size);
 
                 std::cout << "----------" << std::endl << host_
                           << ": header length " << header.size() << std::endl
                           << header;
 
-                // First we'll check for the explicit "Content-Length" length
+                // Field names, and the encoding names we care about, are
+                // case insensitive. Lower casing the whole header up front
+                // keeps the lookups below simple.
+                std::string fields(header);
+                std::transform(fields.begin(), fields.end(), fields.begin(),
+                               [](unsigned char c) { return std::tolower(c); });
+
+                // Servers only compress the body if we asked for it, but
+                // decoding whatever we're handed doesn't hurt either.
+                ContentDecoder::Encoding encoding =
+                    ContentDecoder::Encoding::kIdentity;
+                std::string content_encoding =
+                    header_value(fields, "content-encoding");
+                if (content_encoding == "gzip" ||
+                    content_encoding == "x-gzip") {
+                    encoding = ContentDecoder::Encoding::kGzip;
+                } else if (content_encoding == "deflate") {
+                    encoding = ContentDecoder::Encoding::kDeflate;
+                }
+                decoder_.Reset(encoding);
+
+                // The status line looks like "HTTP/1.1 200 OK". Some statuses
+                // never come with a body, whatever the fields below say.
+                if (fields.compare(0, 5, "http/") != 0 || fields.size() < 12 ||
+                    fields[8] != ' ' || !std::isdigit(
+                        static_cast<unsigned char>(fields[9]))) {
+                    LOG(ERROR) << host_ << ": bad status line";
+                    finish(false);
+                    return;
+                }
+                bool http10 = fields.compare(0, 9, "http/1.0 ") == 0;
+                int status = std::atoi(fields.c_str() + 9);
+                if (status == 101) {
+                    LOG(ERROR) << host_ << ": unexpected protocol switch";
+                    finish(false);
+                    return;
+                }
+                if (status >= 100 && status < 200) {
+                    // Interim responses like "100 Continue" have no body and
+                    // are followed by the real response.
+                    do_recv_http_get_header();
+                    return;
+                }
+                if (status == 204 || status == 304) {
+                    handle_http_get_body();
+                    return;
+                }
+
+                // A chunked transfer, where the body arrives as a series of
+                // length prefixed chunks, takes priority over any
+                // "Content-Length" field (RFC 7230 section 3.3.3).
+                if (header_value(fields, "transfer-encoding").find("chunked")
+                        != std::string::npos) {
+                    do_receive_http_get_chunk_size();
+                    return;
+                }
+
+                // Otherwise we'll check for the explicit "Content-Length"
                 // field. This provides the exact body length in bytes.
-                size_t pos = header.find("Content-Length: ");
-                if (pos != std::string::npos) {
-                    size_t len = std::strtoul(
-                        header.c_str() + pos + sizeof("Content-Length: ") - 1,
-                        nullptr, 10);
-                    do_receive_http_get_body(len - response_.size());
+                std::string content_length =
+                    header_value(fields, "content-length");
+                if (!content_length.empty()) {
+                    size_t len;
+                    if (!parse_length(content_length, 10, &len)) {
+                        LOG(ERROR) << host_ << ": bad content length "
+                                   << content_length;
+                        finish(false);
+                        return;
+                    }
+                    do_receive_http_get_body(len);
                     return;
                 }
 
-                // The other alternative is a chunked transfer. There is a quick
-                // way to determine the remaining length in this case.
-                pos = header.find("Transfer-Encoding: chunked");
-                if (pos != std::string::npos) {
-                    do_receive_http_get_chunked_body();
+                // Without either, the body runs until the server closes the
+                // connection. HTTP/1.0 servers such as "openssl s_server -WWW"
+                // answer this way. An HTTP/1.1 server only does so when it
+                // says it's closing, otherwise it may keep the connection open
+                // and we'd wait forever.
+                if (http10 || header_value(fields, "connection")
+                                  .find("close") != std::string::npos) {
+                    do_receive_http_get_body_until_eof();
                     return;
                 }
 
-                LOG(ERROR) << "Unknown body length";
+                LOG(ERROR) << host_ << ": unknown body length";
+                finish(false);
+            });
+    }
+
+    void do_receive_http_get_body_until_eof() {
+        if (!consume_body(response_.size())) {
+            finish(false);
+            return;
+        }
+
+        stream_read_some(
+            response_.prepare(kReadSize),
+            [this](const boost::system::error_code& ec, std::size_t size) {
+                // TLS servers that skip the close_notify alert show up as a
+                // truncated stream, which is as good as an end of file here.
+                if (ec == asio::error::eof ||
+                    ec == asio::ssl::error::stream_truncated) {
+                    response_.commit(size);
+                    if (!consume_body(response_.size())) {
+                        finish(false);
+                        return;
+                    }
+                    handle_http_get_body();
+                    return;
+                }
+                if (ec) {
+                    LOG(ERROR) << "Error receiving GET body " << ec;
+                    finish(false);
+                    return;
+                }
+
+                response_.commit(size);
+                do_receive_http_get_body_until_eof();
             });
     }
 
     void do_receive_http_get_body(size_t len) {
-        // For "Content-Length" we know exactly how many bytes are left to
-        // receive.
-        asio::async_read(
-            sock_, response_, asio::transfer_exactly(len),
-            std::bind(&HttpClient::handle_http_get_body, this, _1, _2));
+        // Whatever is already sitting in the receive buffer gets decoded
+        // first. Each read after that only asks for what's left of the body
+        // (or the current chunk), so the buffer never holds more than one
+        // read's worth of data.
+        size_t available = std::min(len, response_.size());
+        if (!consume_body(available)) {
+            finish(false);
+            return;
+        }
+        len -= available;
+
+        if (len == 0) {
+            if (chunked_) {
+                do_receive_http_get_chunk_size();
+            } else {
+                handle_http_get_body();
+            }
+            return;
+        }
+
+        stream_read_some(
+            response_.prepare(std::min(len, kReadSize)),
+            [this, len](const boost::system::error_code& ec, std::size_t size) {
+                if (ec) {
+                    LOG(ERROR) << "Error receiving GET body " << ec;
+                    finish(false);
+                    return;
+                }
+
+                response_.commit(size);
+                do_receive_http_get_body(len);
+            });
     }
 
-    void do_receive_http_get_chunked_body() {
-        // For chunked transfers the final body chunk will be terminated by
-        // another "double end of line" delimiter.
-        asio::async_read_until(
-            sock_, response_, "\r\n\r\n",
-            std::bind(&HttpClient::handle_http_get_body, this, _1, _2));
+    void do_receive_http_get_chunk_size() {
+        // Each chunk starts with its length in hex on a line of its own. A
+        // zero length chunk marks the end of the body.
+        chunked_ = true;
+        stream_read_until(
+            "\r\n",
+            [this](const boost::system::error_code& ec, std::size_t size) {
+                if (ec) {
+                    LOG(ERROR) << "Error receiving GET chunk size " << ec;
+                    finish(false);
+                    return;
+                }
+
+                std::string line(response_.data(), size);
+                response_.consume(size);
+
+                // The chunk data is followed by its own "end of line", which
+                // shows up here as an empty line before the next length.
+                if (line == "\r\n") {
+                    do_receive_http_get_chunk_size();
+                    return;
+                }
+
+                // Anything after the length is a chunk extension, which we
+                // can safely ignore.
+                size_t len;
+                if (!parse_length(line, 16, &len)) {
+                    LOG(ERROR) << host_ << ": bad chunk size";
+                    finish(false);
+                    return;
+                }
+                if (len == 0) {
+                    do_receive_http_get_chunk_trailer();
+                    return;
+                }
+                do_receive_http_get_body(len);
+            });
     }
 
-    void handle_http_get_body(const boost::system::error_code& ec,
-                              std::size_t size) {
-        if (ec) {
-            LOG(ERROR) << "Error receiving GET body " << ec;
+    void do_receive_http_get_chunk_trailer() {
+        // Optional trailer fields may follow the last chunk, terminated by an
+        // empty line.
+        stream_read_until(
+            "\r\n",
+            [this](const boost::system::error_code& ec, std::size_t size) {
+                if (ec) {
+                    LOG(ERROR) << "Error receiving GET chunk trailer " << ec;
+                    finish(false);
+                    return;
+                }
+
+                response_.consume(size);
+                if (size > 2) {
+                    do_receive_http_get_chunk_trailer();
+                    return;
+                }
+                handle_http_get_body();
+            });
+    }
+
+    bool consume_body(size_t size) {
+        if (!decoder_.Feed(response_.data(), size,
+                           [this](const char* p, size_t n) {
+                               decoded_bytes_ += n;
+                               if (FLAGS_print_body) {
+                                   body_.append(p, n);
+                               }
+                           })) {
+            LOG(ERROR) << host_ << ": error decoding body";
+            return false;
+        }
+        response_.consume(size);
+        wire_bytes_ += size;
+        return true;
+    }
+
+    void handle_http_get_body() {
+        if (!decoder_.Finish()) {
+            LOG(ERROR) << host_ << ": truncated compressed body";
+            finish(false);
             return;
         }
 
-        LOG(INFO) << host_ << ": received " << size << ", streambuf "
-                  << response_.size();
+        LOG(INFO) << host_ << ": received " << wire_bytes_
+                  << " body bytes, decoded " << decoded_bytes_;
 
-        // We can finally consume the body and print it out if desired.
-        const auto& data = response_.data();
-        std::string body(asio::buffers_begin(data), asio::buffers_end(data));
-        response_.consume(size);
+        stats_.responses++;
+        stats_.wire_bytes += wire_bytes_;
+        stats_.decoded_bytes += decoded_bytes_;
 
         std::cout << "----------" << std::endl << host_ << ": body length "
-                  << body.size() << std::endl;
+                  << decoded_bytes_ << std::endl;
         if (FLAGS_print_body) {
-            std::cout << body;
+            std::cout << body_;
         }
+        finish(true);
+    }
+
+    // Heap memory held on top of the slot by the path, the body and zlib.
+    // OpenSSL's per-connection state isn't visible to us, so it isn't counted.
+    size_t heap_bytes() const {
+        return string_heap_bytes(path_) + string_heap_bytes(body_) +
+            decoder_.zlib_bytes();
     }
 
-    const std::string host_;
+    // Short strings are stored inside the string object itself.
+    static size_t string_heap_bytes(const std::string& s) {
+        const char* object = reinterpret_cast<const char*>(&s);
+        bool inline_data = s.data() >= object && s.data() < object + sizeof(s);
+        return inline_data ? 0 : s.capacity() + 1;
+    }
+
+    // Hands the outcome of the current stage back to whoever started it. This
+    // may well destroy the client, so callers must return right after.
+    void finish(bool ok) {
+        Done done = std::move(done_);
+        done_ = nullptr;
+        done(ok);
+    }
+
+    static SlabPool<HttpClient> pool_;
+
+    const std::string& host_;
     const std::string path_;
 
-    asio::ip::tcp::resolver& resolver_;
+    ResolverPool& resolver_;
+    asio::ssl::context& ssl_context_;
+    TlsSessionCache& session_cache_;
+    HostTable& hosts_;
+    FetchStats& stats_;
+    asio::io_service& io_service_;
+    asio::ip::tcp::endpoint endpoint_;
     asio::ip::tcp::socket sock_;
+    std::unique_ptr<asio::ssl::stream<asio::ip::tcp::socket&>> tls_;
 
-    std::string request_;
-    asio::streambuf response_;
+    ReceiveBuffer response_;
+
+    ContentDecoder decoder_;
+    bool chunked_ = false;
+    size_t wire_bytes_ = 0;
+    size_t decoded_bytes_ = 0;
+    std::string body_;
+
+    Done done_;
+
+    const unsigned short port_;  // Zero for the service's well known port.
+    const bool use_tls_;
+};
+
+SlabPool<HttpClient> HttpClient::pool_;
+
+// Runs every site through the resolve, connect and fetch stages of its
+// HttpClient. Each stage has a bounded queue in front of it and a limit on how
+// many clients it works on at once. A client that finishes a stage keeps its
+// slot until there is room in the next stage's queue, so a backed up stage
+// slows down the ones before it instead of piling up work. Sites are only
+// pulled from the source when the first queue has room.
+class FetchPipeline {
+public:
+    // Returns the next client to run, or nullptr once there are no more.
+    using Source = std::function<HttpClient*()>;
+
+    FetchPipeline(asio::io_service& io_service, Source source)
+        : io_service_(io_service), source_(std::move(source)),
+          stats_timer_(io_service),
+          stages_{{{"resolve", static_cast<size_t>(FLAGS_resolve_concurrency),
+                    static_cast<size_t>(FLAGS_queue_depth)},
+                   {"connect", static_cast<size_t>(FLAGS_connect_concurrency),
+                    static_cast<size_t>(FLAGS_queue_depth)},
+                   {"fetch", static_cast<size_t>(FLAGS_fetch_concurrency),
+                    static_cast<size_t>(FLAGS_queue_depth)}}} { }
+
+    FetchPipeline(const FetchPipeline&) = delete;
+    FetchPipeline& operator=(const FetchPipeline&) = delete;
+
+    void Start() {
+        // The timer has to be armed first, so that pump() can cancel it when
+        // there turns out to be nothing to fetch.
+        start_time_ = std::chrono::steady_clock::now();
+        if (FLAGS_stats_interval_ms > 0) {
+            do_wait_stats();
+        }
+        pump();
+    }
+
+    // Prints the totals for each stage, with throughput averaged over the
+    // whole run.
+    void Report(std::ostream& out) const {
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start_time_).count();
+        for (const auto& stage : stages_) {
+            out << stage.name << ": " << stage.completed << " completed, "
+                << stage.failed << " failed, "
+                << stage.completed / seconds << "/s, max queue depth "
+                << stage.max_queue_depth << std::endl;
+        }
+    }
+
+private:
+    enum StageIndex { kResolve, kConnect, kFetch, kNumStages };
+
+    struct Stage {
+        Stage(const char* name, size_t concurrency, size_t queue_limit)
+            : name(name), concurrency(concurrency), queue_limit(queue_limit) { }
+
+        const char* name;
+        const size_t concurrency;
+        const size_t queue_limit;
+
+        // Clients waiting for a free slot in this stage.
+        std::deque<HttpClient*> queue;
+        // Clients done with this stage but waiting for room in the next one.
+        std::deque<HttpClient*> blocked;
+        // Slots in use, by both running and blocked clients.
+        size_t active = 0;
+
+        size_t completed = 0;
+        size_t failed = 0;
+        size_t max_queue_depth = 0;
+        size_t last_completed = 0;  // As of the previous stats report.
+    };
+
+    void pump() {
+        // Keep moving clients along until nothing else can move. Walking the
+        // stages back to front lets room made near the end of the pipeline
+        // ripple all the way back to the source in a single pass.
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            for (int i = kNumStages - 1; i >= 0; --i) {
+                Stage& stage = stages_[i];
+                if (i + 1 < kNumStages) {
+                    Stage& next = stages_[i + 1];
+                    while (!stage.blocked.empty() &&
+                           next.queue.size() < next.queue_limit) {
+                        enqueue(next, stage.blocked.front());
+                        stage.blocked.pop_front();
+                        stage.active--;
+                        progress = true;
+                    }
+                }
+                while (!stage.queue.empty() &&
+                       stage.active < stage.concurrency) {
+                    HttpClient* c = stage.queue.front();
+                    stage.queue.pop_front();
+                    stage.active++;
+                    run(static_cast<StageIndex>(i), c);
+                    progress = true;
+                }
+            }
+
+            Stage& first = stages_[kResolve];
+            while (!source_done_ && first.queue.size() < first.queue_limit) {
+                HttpClient* c = source_();
+                if (c == nullptr) {
+                    source_done_ = true;
+                    break;
+                }
+                in_flight_++;
+                enqueue(first, c);
+                progress = true;
+            }
+        }
+
+        if (finished()) {
+            // Nothing left to do, so let io_service::run() return.
+            stats_timer_.cancel();
+        }
+    }
+
+    bool finished() const {
+        return source_done_ && in_flight_ == 0;
+    }
+
+    void enqueue(Stage& stage, HttpClient* c) {
+        stage.queue.push_back(c);
+        stage.max_queue_depth =
+            std::max(stage.max_queue_depth, stage.queue.size());
+    }
+
+    void run(StageIndex index, HttpClient* c) {
+        // Asio never calls a completion handler from inside the initiating
+        // function, so the callback can't re-enter pump() while it's running.
+        HttpClient::Done done = std::bind(
+            &FetchPipeline::complete, this, index, c, std::placeholders::_1);
+        switch (index) {
+        case kResolve:
+            c->Resolve(std::move(done));
+            break;
+        case kConnect:
+            c->Connect(std::move(done));
+            break;
+        default:
+            c->Fetch(std::move(done));
+            break;
+        }
+    }
+
+    void complete(StageIndex index, HttpClient* c, bool ok) {
+        Stage& stage = stages_[index];
+        if (ok) {
+            stage.completed++;
+        } else {
+            stage.failed++;
+        }
+
+        if (ok && index + 1 < kNumStages) {
+            stage.blocked.push_back(c);
+        } else {
+            stage.active--;
+            in_flight_--;
+
+            // We're still inside one of the client's completion handlers, so
+            // let the stack unwind before destroying it.
+            io_service_.post([c]() { delete c; });
+        }
+        pump();
+    }
+
+    void do_wait_stats() {
+        stats_timer_.expires_from_now(
+            std::chrono::milliseconds(FLAGS_stats_interval_ms));
+        stats_timer_.async_wait([this](const boost::system::error_code& ec) {
+            // The last completion may have cancelled the timer just after it
+            // expired, in which case the handler still sees success.
+            if (ec || finished()) {
+                return;
+            }
+
+            double seconds = FLAGS_stats_interval_ms / 1000.0;
+            for (auto& stage : stages_) {
+                LOG(INFO) << stage.name << ": queued " << stage.queue.size()
+                          << ", active " << stage.active - stage.blocked.size()
+                          << ", blocked " << stage.blocked.size() << ", "
+                          << (stage.completed - stage.last_completed) / seconds
+                          << "/s";
+                stage.last_completed = stage.completed;
+            }
+            LOG(INFO) << in_flight_ << " in flight, "
+                      << HttpClient::pool().reserved_bytes()
+                      << " bytes of client slots, max RSS "
+                      << max_rss_bytes();
+            do_wait_stats();
+        });
+    }
+
+    asio::io_service& io_service_;
+    Source source_;
+    bool source_done_ = false;
+    size_t in_flight_ = 0;
+
+    asio::steady_timer stats_timer_;
+    std::chrono::steady_clock::time_point start_time_;
+    std::array<Stage, kNumStages> stages_;
 };
 
 int main(int argc, char* argv[]) {
@@ -202,44 +1346,146 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    if (FLAGS_resolve_concurrency <= 0 || FLAGS_connect_concurrency <= 0 ||
+        FLAGS_fetch_concurrency <= 0 || FLAGS_queue_depth <= 0 ||
+        FLAGS_tls_session_cache_size <= 0) {
+        LOG(ERROR) << "Concurrency, queue and cache sizes must be positive";
+        return 1;
+    }
+
     asio::io_service io_service;
-    asio::ip::tcp::resolver resolver(io_service);
-    std::vector<std::unique_ptr<HttpClient>> clients;
-
-    // Loop over all entries in the file, skipping over errors with a warning
-    // to the user.
-    while (!s.eof()) {
-        std::string json_line;
-        try {
-            std::getline(s, json_line);
-            s.peek();
-        } catch (std::exception e) {
-            LOG(WARNING) << "Error reading JSON line: " << e.what();
-            continue;
-        }
-
-        // Each line should parse as a complete JSON object containing our
-        // two expected fields: "host" and "path".
-        try {
-            json j = json::parse(json_line);
-            std::cout << j.at("host").get<std::string>() << ": fetching "
-                      << j.at("path").get<std::string>() << std::endl;
-
-            // We'll create a new HttpClient for each entry in the sites file.
-            // Clearly there's plenty of room for optimization here.
-            std::unique_ptr<HttpClient> c(
-                new HttpClient(
-                    io_service, resolver, j.at("host").get<std::string>(),
-                    j.at("path").get<std::string>()));
-            c->Start();
-
-            clients.push_back(std::move(c));
-        } catch(std::exception e) {
-            LOG(WARNING) << "Error accessing JSON: " << e.what();
+    ResolverPool resolver(io_service, FLAGS_resolve_concurrency);
+    FetchStats stats;
+
+    // A single SSL context, and with it the TLS session cache, is shared by
+    // every https client.
+    boost::system::error_code ec;
+    asio::ssl::context ssl_context(asio::ssl::context::sslv23_client);
+    ssl_context.set_options(asio::ssl::context::default_workarounds |
+                            asio::ssl::context::no_sslv2 |
+                            asio::ssl::context::no_sslv3);
+    if (FLAGS_tls_verify) {
+        ssl_context.set_verify_mode(asio::ssl::verify_peer);
+        if (FLAGS_tls_ca_path.empty()) {
+            ssl_context.set_default_verify_paths(ec);
+        } else {
+            ssl_context.load_verify_file(FLAGS_tls_ca_path, ec);
+        }
+        if (ec) {
+            LOG(ERROR) << "Error loading trusted certificates: "
+                       << ec.message();
+            return 1;
         }
     }
+    TlsSessionCache session_cache(ssl_context);
+    HostTable hosts;
+
+    // Sites are read from the file one at a time, whenever the pipeline has
+    // room for another. Lines with errors are skipped with a warning to the
+    // user.
+    auto next_client = [&]() -> HttpClient* {
+        while (!s.eof()) {
+            std::string json_line;
+            try {
+                std::getline(s, json_line);
+                s.peek();
+            } catch (std::exception e) {
+                LOG(WARNING) << "Error reading JSON line: " << e.what();
+                continue;
+            }
+
+            // Each line should parse as a complete JSON object containing our
+            // two expected fields: "host" and "path". The "service" field is
+            // optional and picks between "http" (the default) and "https",
+            // while an optional "port" overrides the service's well known
+            // port.
+            try {
+                json j = json::parse(json_line);
+                bool use_tls = false;
+                if (j.find("service") != j.end()) {
+                    std::string service = j.at("service").get<std::string>();
+                    if (service != "http" && service != "https") {
+                        LOG(WARNING) << "Unsupported service " << service;
+                        continue;
+                    }
+                    use_tls = service == "https";
+                }
+                unsigned short port = 0;
+                if (j.find("port") != j.end()) {
+                    port = j.at("port").get<unsigned short>();
+                }
+
+                std::cout << j.at("host").get<std::string>() << ": fetching "
+                          << j.at("path").get<std::string>() << std::endl;
+
+                return new HttpClient(
+                    io_service, resolver, ssl_context, session_cache, hosts,
+                    stats, j.at("host").get<std::string>(),
+                    j.at("path").get<std::string>(), port, use_tls);
+            } catch(std::exception e) {
+                LOG(WARNING) << "Error accessing JSON: " << e.what();
+            }
+        }
+        return nullptr;
+    };
 
+    size_t start_rss = max_rss_bytes();
+    FetchPipeline pipeline(io_service, next_client);
+    pipeline.Start();
     io_service.run();
 
+    std::cout << "----------" << std::endl;
+    pipeline.Report(std::cout);
+
+    // With compression enabled the wire byte count should come in well under
+    // the decoded byte count.
+    std::cout << stats.responses
+              << " responses, " << stats.wire_bytes
+              << " body bytes on the wire, " << stats.decoded_bytes
+              << " body bytes decoded" << std::endl;
+    if (stats.decoded_bytes > 0) {
+        std::cout << "wire/decoded ratio "
+                  << static_cast<double>(stats.wire_bytes) / stats.decoded_bytes
+                  << std::endl;
+    }
+
+    // Resumed handshakes skip the key exchange, so their average latency
+    // should come in well under that of full handshakes.
+    std::cout << stats.full_handshakes << " full TLS handshakes";
+    if (stats.full_handshakes > 0) {
+        std::cout << ", average " << stats.full_handshake_time.count() /
+            stats.full_handshakes << "us";
+    }
+    std::cout << std::endl << stats.resumed_handshakes
+              << " resumed TLS handshakes";
+    if (stats.resumed_handshakes > 0) {
+        std::cout << ", average " << stats.resumed_handshake_time.count() /
+            stats.resumed_handshakes << "us";
+    }
+    std::cout << std::endl;
+
+    // The pipeline caps how many clients exist at once, so memory use should
+    // level off at the peak number of requests in flight however long the
+    // sites file is. Each request in flight holds a slot, which includes its
+    // receive buffer, plus whatever heap memory its client needed on top.
+    const auto& pool = HttpClient::pool();
+    std::cout << pool.peak_in_use() << " peak requests in flight, "
+              << pool.slot_size() << " bytes per client slot (including a "
+              << ReceiveBuffer::kCapacity << " byte receive buffer), "
+              << pool.reserved_bytes() << " bytes of client slots" << std::endl;
+    if (stats.clients > 0) {
+        std::cout << stats.client_heap_bytes / stats.clients
+                  << " heap bytes per client for the path, body and zlib state"
+                  << " (TLS state not included)" << std::endl;
+    }
+
+    // RSS also takes in the TLS session cache, the host table and library
+    // state shared by all clients, so this is only a rough estimate.
+    if (pool.peak_in_use() > 0) {
+        std::cout << "~" << (max_rss_bytes() - start_rss) / pool.peak_in_use()
+                  << " bytes of RSS growth per in-flight request, estimated"
+                  << " including shared caches" << std::endl;
+    }
+
     return 0;
 }
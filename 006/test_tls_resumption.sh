@@ -0,0 +1,70 @@
+#!/bin/bash
+# Fetches the same https site several times from a local "openssl s_server"
+# with a freshly generated self-signed certificate, and checks that the TLS
+# session cache gets repeat connections to resume their sessions.
+
+OPENSSL=$(which openssl)
+if [[ -z "$OPENSSL" ]]; then
+    echo "Please install openssl before running this script."
+    exit 1
+fi
+
+if [[ "$#" -lt 1 || "$#" -gt 3 ]]; then
+    echo "Usage:"
+    echo "    $0 <path_to_http_client> [fetch_count] [port]"
+    exit 1
+fi
+
+HTTP_CLIENT=$(realpath "$1")
+FETCH_COUNT=${2:-5}
+PORT=${3:-44330}
+
+WORK_DIR=$(mktemp -d) || exit 1
+SERVER_PID=
+cleanup() {
+    if [[ -n "$SERVER_PID" ]]; then
+        kill "$SERVER_PID" 2> /dev/null
+        wait "$SERVER_PID" 2> /dev/null
+    fi
+    rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+# The certificate doubles as its own CA, so the client can verify it with
+# --tls_ca_path like any other server certificate.
+$OPENSSL req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" \
+    -addext "subjectAltName=DNS:localhost" \
+    -keyout "$WORK_DIR/key.pem" -out "$WORK_DIR/cert.pem" 2> /dev/null || exit 1
+
+# With -WWW the server hands out files relative to its working directory.
+echo "Hello from the TLS stand-in server" > "$WORK_DIR/index.txt"
+(cd "$WORK_DIR" && exec $OPENSSL s_server -quiet -WWW -accept "$PORT" \
+    -cert cert.pem -key key.pem) &
+SERVER_PID=$!
+sleep 1
+
+for i in $(seq "$FETCH_COUNT"); do
+    echo "{ \"host\": \"localhost\", \"path\": \"/index.txt\"," \
+         "\"service\": \"https\", \"port\": $PORT }"
+done > "$WORK_DIR/sites.json"
+
+# Fetching one site at a time gives each session ticket a chance to arrive
+# before the next connection starts.
+"$HTTP_CLIENT" --sites_path="$WORK_DIR/sites.json" \
+    --tls_ca_path="$WORK_DIR/cert.pem" --stats_interval_ms=0 \
+    --connect_concurrency=1 --fetch_concurrency=1 --queue_depth=1 \
+    > "$WORK_DIR/output.txt" || exit 1
+grep -E "responses|TLS handshakes" "$WORK_DIR/output.txt"
+
+RESPONSES=$(sed -n 's/^\([0-9]*\) responses.*/\1/p' "$WORK_DIR/output.txt")
+RESUMED=$(sed -n 's/^\([0-9]*\) resumed TLS handshakes.*/\1/p' \
+    "$WORK_DIR/output.txt")
+if [[ "$RESPONSES" != "$FETCH_COUNT" ]]; then
+    echo "Expected $FETCH_COUNT responses, got ${RESPONSES:-none}"
+    exit 1
+fi
+if [[ -z "$RESUMED" || "$RESUMED" -eq 0 ]]; then
+    echo "No TLS handshakes were resumed"
+    exit 1
+fi
+echo "Session resumption works"
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Compares the iostream and block copying modes of real_eof on a large newline
+# delimited JSON file, and checks that both produce identical output.
+
+if [[ "$#" -lt 1 || "$#" -gt 2 ]]; then
+    echo "Usage:"
+    echo "    $0 <path_to_real_eof> [size_in_mb]"
+    exit 1
+fi
+
+REAL_EOF=$1
+SIZE_MB=${2:-2048}
+
+INPUT=$(mktemp) || exit 1
+trap 'rm -f "$INPUT"' EXIT
+
+echo "Generating ${SIZE_MB}MB of ndjson..."
+yes '{ "host": "www.google.com", "path": "/", "service": "https" }' | \
+    head -c "$((SIZE_MB * 1024 * 1024))" > "$INPUT" || exit 1
+
+echo "iostream mode:"
+time "$REAL_EOF" < "$INPUT" > /dev/null
+
+echo "block mode:"
+time "$REAL_EOF" --fast < "$INPUT" > /dev/null
+
+if cmp -s <("$REAL_EOF" < "$INPUT") <("$REAL_EOF" --fast < "$INPUT"); then
+    echo "Outputs match"
+else
+    echo "Outputs differ!"
+    exit 1
+fi
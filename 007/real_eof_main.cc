@@ -1,7 +1,14 @@
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <vector>
 
-int main(int argc, char* argv[]) {
+// Copies stdin to stdout line by line, only writing a newline when another
+// line follows it.
+int copy_lines() {
     std::string s;
     while (std::getline(std::cin, s)) {
         std::cout << s;
@@ -11,3 +18,72 @@ int main(int argc, char* argv[]) {
     }
     return 0;
 }
+
+bool write_all(const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error writing stdout: " << std::strerror(errno)
+                      << std::endl;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Produces the same output as copy_lines(), but moves large blocks with plain
+// read() and write() calls instead of going through iostreams one line at a
+// time. Only the newline at the very end of the input gets dropped, so there
+// is no need to look for line breaks at all. The one thing to watch for is a
+// block ending in a newline, which is held back until we know more data
+// follows.
+int copy_blocks() {
+    const size_t kBlockSize = 1 << 20;
+
+    // The first byte is reserved for a newline held back from the previous
+    // block, so each block goes out with a single write.
+    std::vector<char> buf(kBlockSize + 1);
+    bool pending_newline = false;
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buf.data() + 1, kBlockSize);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error reading stdin: " << std::strerror(errno)
+                      << std::endl;
+            return 1;
+        }
+        if (n == 0) {
+            // End of input. A held back newline was the final one, so it
+            // never gets written.
+            return 0;
+        }
+
+        char* begin = buf.data() + 1;
+        char* end = begin + n;
+        if (pending_newline) {
+            *--begin = '\n';
+        }
+        pending_newline = end[-1] == '\n';
+        if (pending_newline) {
+            --end;
+        }
+
+        if (!write_all(begin, end - begin)) {
+            return 1;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--fast") {
+        return copy_blocks();
+    }
+    return copy_lines();
+}